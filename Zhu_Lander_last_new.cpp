@@ -159,6 +159,7 @@
   Standard C libraries
 */
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <iostream>
 #include <math.h>
@@ -168,7 +169,7 @@
 /************Sensor Fail *********************/
 bool X_OK=true,Y_OK=true,VX_OK=true,VY_OK=true,TH_OK=true,Sonar_OK=true,Angle_Flag=true;
 
-int T=15,l=0,n=1,Rotate_n=0,XT=15;
+int T=15,l=0,n=1,XT=15;
 
 double Position_Y_test=0;
 
@@ -176,7 +177,15 @@ double S_X[30],X_Current=0,X_VX_Current=0,X_Past=0,RMS_X=0,RMS_Past_X=0,Start_X=
 double S_Y[30],Y_Current=0,Y_VY_Current=0,Y_Past=0,RMS_Y=0,RMS_Past_Y=0,Start_Y=0,Position_Y_N,RMS_YT=0,RMS_VYT=0,sp_py=0.37,bound_y=5;
 double S_VX[30],VX_Current=0,VX_X_Current=0,VX_Past=0,VX_X_Past=0,RMS_VX=0,RMS_Past_VX=0,Start_VX=0,Velocity_X_N,sp_vx=0.37,bound_vx=10;
 double S_VY[30],VY_Current=0,VY_Y_Current=0,VY_Past=0,VY_Y_Past=0,RMS_VY=0,RMS_Past_VY=0,Start_VY=0,Velocity_Y_N,sp_vy=0.80,bound_vy=10;
-double S_TH[30],TH_Current=0,TH_Past=0,RMS_TH=0,RMS_Past_TH=0,Start_TH=0,TH_Position_N,TH_PAST_Node=0,RMS_THT=0,Rotate_sp=0.442,bound_th=2;
+double S_TH[30],TH_Current=0,TH_Past=0,RMS_TH=0,RMS_Past_TH=0,Start_TH=0,TH_Position_N,TH_PAST_Node=0,RMS_THT=0,bound_th=2;
+double TH_Est=0;
+double Rot_Pending=0;//degrees of commanded rotation not done yet
+bool TH_Turned=false;//a rotation was pending during this window
+//Last good window carried forward by the rotations asked for since,
+//readings far from it mean the sensor is gone even while turning
+#define TH_PRED_TOL 15.0 //degrees, mean error over a window
+double TH_Pred=0,TH_Err=0,TH_Res=0;
+int TH_Err_n=0;
 
 void Position_A_X(void){
     double temp=0;
@@ -440,13 +449,31 @@ void Velocity_A_Y(void){
     }
 }
 
+//Shortest signed turn (degrees, clockwise positive) from 'from' to 'to'
+double Angle_Diff(double to,double from){
+    double d=fmod(to-from,360.0);
+    if(d>180) d-=360;
+    if(d<=-180) d+=360;
+    return d;
+}
+
+double Angle_Wrap(double a){
+    a=fmod(a,360.0);
+    if(a<0) a+=360;
+    return a;
+}
+
 void Position_A_TH(void){
     double temp=0;
     double Angle_temp=0;
     
+    if(Rot_Pending!=0) TH_Turned=true;
     if(l<T){
         //Angle convert to 360---> -angle;
         Angle_temp=Angle();
+        TH_Err+=fabs(Angle_Diff(Angle_temp,TH_Pred));
+        TH_Res+=Angle_Diff(Angle_temp,TH_Pred);
+        TH_Err_n++;
         //        printf("Angle_temp      : %f\n",Angle_temp);
         if(l==0) {
             S_TH[0]=Angle_temp;
@@ -465,7 +492,7 @@ void Position_A_TH(void){
         }
         
         //        printf("Angle_temp after: %f\n",Angle_temp);
-        l=l+1;
+        //        l=l+1;
         return;
     }else{
         TH_Current=TH_Current/l;
@@ -477,7 +504,7 @@ void Position_A_TH(void){
         RMS_THT=RMS_THT/l;
         RMS_THT=sqrtf(RMS_THT);
         RMS_TH=RMS_THT;
-        n=n+1;
+        //        n=n+1;
         if(n<=2) temp = 0;
         else temp=fabs(RMS_TH-RMS_Past_TH)/fabs(RMS_Past_TH);
         printf("RMS_PAST_X/RMS_X= %f\n",temp);
@@ -492,20 +519,23 @@ void Position_A_TH(void){
          if(TH_Position_N>360) TH_Position_N=TH_Position_N-360;
          }*/
         
-        if(temp>bound_th && TH_OK) {
+        //Turning spreads the window by itself, only judge windows where
+        //we did not ask for a rotation
+        double err=TH_Err_n>0 ? TH_Err/TH_Err_n : 0;
+        if(n<=2) err=0;
+        if(((temp>bound_th && !TH_Turned) || err>TH_PRED_TOL) && TH_OK) {
             TH_OK = false;
-            Start_TH = TH_Past;
+            Start_TH = TH_Pred;//TH_Past lags by up to a window of turning
             if(Start_TH<0) Start_TH=360+Start_TH;
             if(Start_TH>360) Start_TH=Start_TH-360;
             printf("Position TH: Fail....\n");
             printf("Start Position TH: %f\n",Start_TH);
+            TH_Est=Start_TH;
         }
         
         
         if(!TH_OK){
-            TH_Position_N = Start_TH + Rotate_n*Rotate_sp;
-            if(TH_Position_N<0) TH_Position_N=360+TH_Position_N;
-            if(TH_Position_N>360) TH_Position_N=TH_Position_N-360;
+            TH_Position_N = TH_Est;
         }else{
             
             TH_Position_N=TH_Current;
@@ -515,16 +545,102 @@ void Position_A_TH(void){
         
         
         RMS_THT=0;
+        TH_Turned=Rot_Pending!=0;
         TH_Past=TH_Current;
         Angle_temp=Angle();
         TH_Current=Angle_temp;
         S_TH[0]=Angle_temp;
+        //Move the prediction by the mean of the window, one noisy
+        //reading would carry its noise into the next window's test
+        if(TH_OK && TH_Err_n>0) TH_Pred=Angle_Wrap(TH_Pred+TH_Res/TH_Err_n);
+        TH_Err=0;
+        TH_Res=0;
+        TH_Err_n=0;
         
-        l=1;
+        //        l=1;
         return;
     }
 }
 
+//Angle sensor fail: Angle() is useless, so follow the rotation we asked
+//for. Rotate() only keeps the latest command and turns at most
+//MAX_ROT_RATE radians per step, so integrate the pending rotation at
+//that rate. The main thruster pushes along the lander's axis, which lets
+//us correct the drift from the measured change in velocity.
+#define TH_FIX_TICKS 40
+
+double MT_Cmd=0,LT_Cmd=0,RT_Cmd=0;//last commanded thruster power
+int TH_Fix_n=0;
+double TH_Fix_VX[2],TH_Fix_VY[2],TH_Fix_AX,TH_Fix_AY;
+
+void Fire_Main(double power){
+    MT_Cmd=power;
+    Main_Thruster(power);
+}
+
+void Fire_Left(double power){
+    LT_Cmd=power;
+    Left_Thruster(power);
+}
+
+void Fire_Right(double power){
+    RT_Cmd=power;
+    Right_Thruster(power);
+}
+
+void Robust_Rotate(double angle){
+    Rot_Pending=angle;
+    Rotate(angle);
+}
+
+void Angle_Estimate(void){
+    double rate=MAX_ROT_RATE*180/PI;
+    double d=fmin(fabs(Rot_Pending),rate);
+    if(Rot_Pending<0) d=-d;
+    Rot_Pending-=d;
+    TH_Pred=Angle_Wrap(TH_Pred+d);
+
+    if(TH_OK){
+        TH_Est=TH_Position_N;
+        TH_Fix_n=0;
+        return;
+    }
+    TH_Est=Angle_Wrap(TH_Est+d);
+
+    //Main thruster firing, not turning: compare the average velocity of
+    //the two halves of the window to get the thrust direction. The side
+    //thrusters push at right angles to it, take off what we expect them
+    //to have added at the estimated angle
+    if(MT_Cmd>0.5 && Rot_Pending==0 && VX_OK && VY_OK){
+        int h=TH_Fix_n<TH_FIX_TICKS/2 ? 0 : 1;
+        double th=TH_Est*PI/180,side=LT_ACCEL*LT_Cmd-RT_ACCEL*RT_Cmd;
+        if(TH_Fix_n==0){
+            TH_Fix_VX[0]=TH_Fix_VX[1]=0;
+            TH_Fix_VY[0]=TH_Fix_VY[1]=0;
+            TH_Fix_AX=TH_Fix_AY=0;
+        }
+        TH_Fix_VX[h]+=Velocity_X_N;
+        TH_Fix_VY[h]+=Velocity_Y_N;
+        TH_Fix_AX+=side*cos(th);
+        TH_Fix_AY-=side*sin(th);
+        TH_Fix_n++;
+        if(TH_Fix_n==TH_FIX_TICKS){
+            //the two half-window means are TH_FIX_TICKS/2 steps apart
+            double dt=TH_FIX_TICKS/2*T_STEP,k=2.0/TH_FIX_TICKS;
+            double ax=(TH_Fix_VX[1]-TH_Fix_VX[0])*k/dt-TH_Fix_AX/TH_FIX_TICKS;
+            double ay=(TH_Fix_VY[1]-TH_Fix_VY[0])*k/dt+G_ACCEL-TH_Fix_AY/TH_FIX_TICKS;
+            if(sqrt(ax*ax+ay*ay)>0.5*MT_ACCEL*MT_Cmd){
+                double meas=atan2(ax,ay)*180/PI;
+                TH_Est=Angle_Wrap(TH_Est+0.5*Angle_Diff(meas,TH_Est));
+            }
+            TH_Fix_n=0;
+        }
+    }else{
+        TH_Fix_n=0;
+    }
+    TH_Position_N=TH_Est;
+}
+
 /*************Sensor Fail End*************************/
 
 //********************Thruster Fail*******************//
@@ -534,184 +650,1213 @@ void Position_A_TH(void){
 //For set degree
 //check the Thruster state to set landing action
 
+//The MT_OK/RT_OK/LT_OK flags are not always there to tell us, so watch
+//the thrusters ourselves. A velocity observer is driven by the thrust we
+//commanded and pulled towards the velocity sensors. If a thruster does
+//not deliver what we asked for, the observer keeps lagging along that
+//thruster's axis; a lag that stays for HM_TICKS means dead (almost
+//nothing), weak (part of it) or stuck (pushing while commanded off).
+#define HM_GAIN 0.02     //observer pull towards the sensors per step
+#define HM_TICKS 60
+#define HM_MT 0
+#define HM_LT 1
+#define HM_RT 2
+
+double HM_VX=0,HM_VY=0;
+bool HM_Init=false;
+int HM_Dead[3]={0,0,0},HM_Weak[3]={0,0,0},HM_Stuck[3]={0,0,0};
+int HM_Low_n[3]={0,0,0},HM_Part_n[3]={0,0,0},HM_On_n[3]={0,0,0};
+
+//World acceleration direction (x right, y up) of each thruster at the
+//current angle
+void HM_Axis(int t,double *ux,double *uy){
+    double th=TH_Position_N*PI/180;
+    if(t==HM_MT){ *ux=sin(th);  *uy=cos(th);  }
+    if(t==HM_LT){ *ux=cos(th);  *uy=-sin(th); }
+    if(t==HM_RT){ *ux=-cos(th); *uy=sin(th);  }
+}
+
+void Thruster_Monitor(void){
+    double acc[3]={MT_ACCEL,LT_ACCEL,RT_ACCEL};
+    double cmd[3]={MT_Cmd,LT_Cmd,RT_Cmd};
+    const char *name[3]={"Main","Left","Right"};
+
+    if(!VX_OK || !VY_OK){
+        HM_Init=false;
+        return;
+    }
+    if(!HM_Init){
+        HM_VX=Velocity_X_N;
+        HM_VY=Velocity_Y_N;
+        HM_Init=true;
+        return;
+    }
+
+    //Predict with the thrusters we believe in
+    double ax=0,ay=-G_ACCEL,ux,uy;
+    for(int t=0;t<3;t++){
+        if(HM_Dead[t]) continue;
+        HM_Axis(t,&ux,&uy);
+        ax+=ux*acc[t]*cmd[t];
+        ay+=uy*acc[t]*cmd[t];
+    }
+    HM_VX+=ax*T_STEP;
+    HM_VY+=ay*T_STEP;
+    double ex=Velocity_X_N-HM_VX,ey=Velocity_Y_N-HM_VY;
+    HM_VX+=HM_GAIN*ex;
+    HM_VY+=HM_GAIN*ey;
+
+    //In steady state a missing acceleration 'da' shows up as an
+    //innovation of da*T_STEP/HM_GAIN
+    if(Rot_Pending!=0) return;//axis not known well while turning
+    int on=0;
+    for(int t=0;t<3;t++) if(cmd[t]>0.3) on++;
+    for(int t=0;t<3;t++){
+        HM_Axis(t,&ux,&uy);
+        double da=(ex*ux+ey*uy)*HM_GAIN/T_STEP;
+        if(on==1 && cmd[t]>0.3 && !HM_Dead[t]){
+            double miss=-da/(acc[t]*cmd[t]);//1=nothing delivered
+            HM_Low_n[t]=miss>0.7 ? HM_Low_n[t]+1 : 0;
+            HM_Part_n[t]=(miss>0.3 && miss<=0.7) ? HM_Part_n[t]+1 : 0;
+            if(HM_Low_n[t]==HM_TICKS){
+                HM_Dead[t]=1;
+                printf("%s thruster: dead\n",name[t]);
+            }
+            if(HM_Part_n[t]==HM_TICKS && !HM_Weak[t]){
+                HM_Weak[t]=1;
+                printf("%s thruster: weak\n",name[t]);
+            }
+        }
+        if(on==0){
+            HM_On_n[t]=da>0.5*acc[t] ? HM_On_n[t]+1 : 0;
+            if(HM_On_n[t]==HM_TICKS && !HM_Stuck[t]){
+                HM_Stuck[t]=1;
+                printf("%s thruster: stuck on\n",name[t]);
+            }
+        }
+    }
+}
+
 bool MT_OK_N = true,RT_OK_N=true,LT_OK_N=true;
 
 void setMode(void)
 {
-    if(MT_OK){
+    //Trust the failure flags and our own thruster monitor
+    int MT_Good=MT_OK && !HM_Dead[HM_MT];
+    int RT_Good=RT_OK && !HM_Dead[HM_RT];
+    int LT_Good=LT_OK && !HM_Dead[HM_LT];
+
+    if(MT_Good){
         printf("MT_OK...\n");
-        if(RT_OK){
-            if(LT_OK) {
-                MT_OK_N=MT_OK;
-                RT_OK_N=RT_OK;
-                LT_OK_N=LT_OK;
+        if(RT_Good){
+            if(LT_Good) {
+                MT_OK_N=MT_Good;
+                RT_OK_N=RT_Good;
+                LT_OK_N=LT_Good;
             }else{
-                MT_OK_N=MT_OK;
-                RT_OK_N=!RT_OK;
-                LT_OK_N=LT_OK;
+                MT_OK_N=MT_Good;
+                RT_OK_N=!RT_Good;
+                LT_OK_N=LT_Good;
             }
             
         }else{
-            if(LT_OK) {
-                MT_OK_N=MT_OK;
-                RT_OK_N=RT_OK;
-                LT_OK_N=!LT_OK;
+            if(LT_Good) {
+                MT_OK_N=MT_Good;
+                RT_OK_N=RT_Good;
+                LT_OK_N=!LT_Good;
             }else{
-                MT_OK_N=MT_OK;
-                RT_OK_N=RT_OK;
-                LT_OK_N=LT_OK;
+                MT_OK_N=MT_Good;
+                RT_OK_N=RT_Good;
+                LT_OK_N=LT_Good;
             }
         }
     }else{
         printf("MT_Fail...\n");
-        if(RT_OK){
+        if(RT_Good){
             printf("RT_OK...\n");
-            if(LT_OK){
+            if(LT_Good){
                 printf("LT_OK...\n");
-                MT_OK_N=MT_OK;
-                RT_OK_N=RT_OK;
-                LT_OK_N=!LT_OK;
+                MT_OK_N=MT_Good;
+                RT_OK_N=RT_Good;
+                LT_OK_N=!LT_Good;
             }else{
                 printf("LT_Fail...\n");
-                MT_OK_N=MT_OK;
-                RT_OK_N=RT_OK;
-                LT_OK_N=LT_OK;
+                MT_OK_N=MT_Good;
+                RT_OK_N=RT_Good;
+                LT_OK_N=LT_Good;
             }
             
         }else{
             printf("MT_Fail...\n");
             printf("RT_Fail...\n");
             printf("LT_OK...\n");
-            MT_OK_N=MT_OK;
-            RT_OK_N=RT_OK;
-            LT_OK_N=LT_OK;
+            MT_OK_N=MT_Good;
+            RT_OK_N=RT_Good;
+            LT_OK_N=LT_Good;
         }
         
     }
     
 }
 
+//Rotation planner. stay_X_degree() only records the attitude we want,
+//the last call of the tick wins, and Rot_Commit() acts on it once per
+//tick. Turn the short way round, and only send a new Rotate() when the
+//target changes or the last turn has run out (Rotate() is noisy and can
+//stop a little short). Re-sending the same turn every tick would throw
+//away the rotation already in progress.
+double Rot_Target=-1,Rot_Want=-1;
+
 void stay_X_degree(double X) {
-    if (fabs(Angle()-X) > 1) {
-        if (X >= 270 && Angle()<=90) Rotate(-Angle()+X-360);
-        else if (Angle() >= X + 180) Rotate(360 - Angle() + X);
-        else Rotate(X - Angle());
+    Rot_Want=X;
+}
+
+void Rot_Commit(void) {
+    if (Rot_Want<0) return;//nobody asked for an attitude
+    double X=Rot_Want,d=Angle_Diff(X,TH_Position_N);
+    Rot_Want=-1;
+    if (fabs(d) <= 1) {
+        Rot_Target=X;
         return;
     }
+    if (Rot_Target<0 || fabs(Angle_Diff(X,Rot_Target))>1 || Rot_Pending==0) {
+        Robust_Rotate(d);
+        Rot_Target=X;
+    }
 }
 
+//Seconds until we point at X, turning at MAX_ROT_RATE
+double Time_To_Align(double X) {
+    double rate=MAX_ROT_RATE*180/PI;//degrees per step
+    return ceil(fabs(Angle_Diff(X,TH_Position_N))/rate)*T_STEP;
+}
 
 
-void Robust_Right_Thruster(double power) {
-    printf("Want to active Right Thruster\n");
-    if  (RT_OK_N) {
-        //RT is ok
-        stay_X_degree(0);
-/*        if(Angle()<350 and Angle()>5){
-            Main_Thruster(0);
-            Right_Thruster(0);
-            Left_Thruster(0);
-            return;
-        }*/
-        
-        
-        Left_Thruster(0);
-        Right_Thruster(power);
-     
-    } else if (MT_OK_N) {//RT is failure. use MT(360-90) or LT (180)
-        stay_X_degree(360-75);
-        if(Angle()>290 && Angle()<275) return;
-        Main_Thruster(power);
-    } else {
-        // Exceeded velocity limit, brake
-        stay_X_degree(360-175);
-        double x=Angle();
-        printf("Want to active Right Thruster Ag = %f\n",x);
-        if(Angle()>200 and Angle()<165){
-            Left_Thruster(0);
-            Right_Thruster(0);
-            return;
+
+//Control allocation. Given the acceleration we want (world frame, x right,
+//y up) and the thrusters we can use, find the attitude and the power
+//for each thruster. The thrusters push along fixed directions of the
+//lander (main along its axis, left to its right, right to its left),
+//so each set of working thrusters covers a cone of body directions.
+//The table holds, per set and per 5 degree bin of wanted direction,
+//the attitudes from which that cone contains the wanted direction.
+#define ALLOC_BINS 72
+#define ALIGN_TICKS 2    //fire once we are this many steps of turning away
+
+int Alloc_n[8][ALLOC_BINS];
+double Alloc_Lo[8][ALLOC_BINS][2],Alloc_Hi[8][ALLOC_BINS][2];
+bool Alloc_Init=false;
+
+void Alloc_Build(void){
+    //mask bit 0: main, bit 1: left, bit 2: right
+    for(int m=0;m<8;m++){
+        //body direction intervals (clockwise from the lander axis)
+        double lo[2],hi[2];
+        int k=0;
+        bool M=m&1,L=m&2,R=m&4;
+        if(M&&L&&R){ lo[k]=-90; hi[k++]=90; }
+        else if(M&&L){ lo[k]=0; hi[k++]=90; }
+        else if(M&&R){ lo[k]=-90; hi[k++]=0; }
+        else{
+            if(M){ lo[k]=0; hi[k++]=0; }
+            if(L){ lo[k]=90; hi[k++]=90; }
+            if(R){ lo[k]=-90; hi[k++]=-90; }
+        }
+        for(int b=0;b<ALLOC_BINS;b++){
+            double dir=b*360.0/ALLOC_BINS;
+            Alloc_n[m][b]=k;
+            for(int c=0;c<k;c++){
+                Alloc_Lo[m][b][c]=Angle_Wrap(dir-hi[c]);
+                Alloc_Hi[m][b][c]=Alloc_Lo[m][b][c]+(hi[c]-lo[c]);
+            }
         }
-        
-        Right_Thruster(0);
-        Left_Thruster(power);
     }
-    return;
+    Alloc_Init=true;
 }
 
-void Robust_Left_Thruster(double power) {
-    printf("Want to active Left Thruster\n");
-    if  (LT_OK_N) {
-        //LT is ok
-        stay_X_degree(0);
-        double x=Angle();
-        printf("Want to active Left Thruster Ag = %f\n",x);
-/*      if(Angle()<350 and Angle()>5){
-            return;
-        }*/
-        Right_Thruster(0);
-        Left_Thruster(power);
-        
-    } else if (MT_OK_N) {//LT is failure. use MT(90) or RT (180)
-        stay_X_degree(75);
-        if(Angle()>50 && Angle()<90) return;
-        
-        Main_Thruster(power);
-    } else {
-        // LT and MT is fail
-        stay_X_degree(175);
-        double x=Angle();
-        printf("Want to active Left Thruster Ag = %f\n",x);
-        if(Angle()<170 && Angle()>180){
-            Left_Thruster(0);
-            Right_Thruster(0);
-            return;
+//Same as Thrust_Allocate() for any set of thrusters m, turning from 'from'
+bool Alloc_Mask(int m,double from,double ax,double ay,double *att,double *pm,double *pl,double *pr){
+    if(!Alloc_Init) Alloc_Build();
+    double dir=Angle_Wrap(atan2(ax,ay)*180/PI);
+    int b=(int)floor(dir*ALLOC_BINS/360.0+0.5)%ALLOC_BINS;
+    *pm=*pl=*pr=0;
+    if(Alloc_n[m][b]==0) return false;
+
+    //Stay as upright as possible, then turn as little as possible
+    double best=0,cost=1e9;
+    for(int c=0;c<Alloc_n[m][b];c++){
+        double lo=Alloc_Lo[m][b][c],w=Alloc_Hi[m][b][c]-lo;
+        double cand[3]={lo,lo+w,lo+fmin(fmod(360-lo,360.0),w)};
+        for(int q=0;q<3;q++){
+            double e=fabs(Angle_Diff(cand[q],0))+0.001*fabs(Angle_Diff(cand[q],from));
+            if(e<cost){
+                cost=e;
+                best=Angle_Wrap(cand[q]);
+            }
         }
-        Left_Thruster(0);
-        Right_Thruster(power);
     }
-    return;
+    *att=best;
+
+    //Wanted acceleration in the lander's frame at that attitude
+    double mag=sqrt(ax*ax+ay*ay),phi=(dir-best)*PI/180;
+    double bx=mag*sin(phi),by=mag*cos(phi);
+    if((m&1) && by>0) *pm=fmin(1,by/MT_ACCEL);
+    if((m&2) && bx>0) *pl=fmin(1,bx/LT_ACCEL);
+    if((m&4) && bx<0) *pr=fmin(1,-bx/RT_ACCEL);
+    return true;
+}
+
+//Returns false if no working thruster can push that way
+bool Thrust_Allocate(double ax,double ay,double *att,double *pm,double *pl,double *pr){
+    int m=(MT_OK_N?1:0)|(LT_OK_N?2:0)|(RT_OK_N?4:0);
+    return Alloc_Mask(m,TH_Position_N,ax,ay,att,pm,pl,pr);
+}
+
+//The horizontal and the vertical code both ask for thrust in the same
+//tick, under failures often at different attitudes. Keep the latest
+//request of each axis and allocate their sum, so there is one attitude
+//per tick. Last tick's request stands in until its axis asks again,
+//which keeps the attitude steady from the first call of the tick on.
+double Want_AX=0,Want_AY=0;
+int Want_X_Tick=-2,Want_Y_Tick=-2,Thrust_Tick=0;
+
+void Robust_Thrust(void){
+    double att,pm,pl,pr;
+    double ax=Want_X_Tick>=Thrust_Tick-1 ? Want_AX : 0;
+    double ay=Want_Y_Tick>=Thrust_Tick-1 ? Want_AY : 0;
+    if(ax==0 && ay==0){
+        //nothing wanted on either axis, stay upright with all off
+        stay_X_degree(0);
+        Fire_Main(0);
+        Fire_Left(0);
+        Fire_Right(0);
+        return;
+    }
+    if(!Thrust_Allocate(ax,ay,&att,&pm,&pl,&pr)) return;
+    stay_X_degree(att);
+    //Wrong way round, turn first and push later. Whatever was firing
+    //at the old attitude would push the wrong way while we turn.
+    if(Time_To_Align(att)>ALIGN_TICKS*T_STEP){
+        Fire_Main(0);
+        Fire_Left(0);
+        Fire_Right(0);
+        return;
+    }
+    Fire_Main(pm);
+    Fire_Left(pl);
+    Fire_Right(pr);
+}
+
+void Robust_Thrust_X(double ax){
+    Want_AX=ax;
+    Want_X_Tick=Thrust_Tick;
+    Robust_Thrust();
+}
+
+void Robust_Thrust_Y(double ay){
+    Want_AY=ay;
+    Want_Y_Tick=Thrust_Tick;
+    Robust_Thrust();
+}
+
+//Both axes off, also forgets last tick's requests
+void Robust_Off(void){
+    Want_AX=Want_AY=0;
+    Want_X_Tick=Want_Y_Tick=Thrust_Tick;
+    Robust_Thrust();
+}
+
+void Robust_Right_Thruster(double power) {
+    printf("Want to active Right Thruster\n");
+    Robust_Thrust_X(-RT_ACCEL*fmin(power,1));
+}
+
+void Robust_Left_Thruster(double power) {
+    printf("Want to active Left Thruster\n");
+    Robust_Thrust_X(LT_ACCEL*fmin(power,1));
 }
 
 void Robust_Main_Thruster(double power) {
     printf("Want to active Main Thruster\n");
-    if  (MT_OK_N) {
-        //LT is ok
-        stay_X_degree(0);
- /*       if(Angle()<350 and Angle()>5){
-            Main_Thruster(0);
-            Right_Thruster(0);
-            Left_Thruster(0);
-            return;
-        }*/
-            Main_Thruster(power);
-    } else if (RT_OK_N) {//MT is failure. use RT(90)
-        stay_X_degree(90);
-        double x=Angle();
-        printf("Want to active Main Thruster Ag = %f\n",x);
-        if(Angle()>105 && Angle()<75){
-            Left_Thruster(0);
-            Right_Thruster(0);
-            return;
+    Robust_Thrust_Y(MT_ACCEL*fmin(power,1));
+}
+
+//********************Sonar Map*******************//
+
+//The sonar only gives us what is around us right now, so keep an
+//occupancy grid of everything it has seen. The 1024x1024 map is cut
+//into MAP_CELL x MAP_CELL pixel cells, each one holds a log-odds value
+//(>0 occupied, <0 free, 0 never seen).
+#define MAP_CELL 8
+#define MAP_N (1024/MAP_CELL)
+#define LO_HIT 12     //added to the cell a ray ends in
+#define LO_MISS 3     //taken from every cell a ray passes through
+#define LO_MAX 100
+#define LO_OCC 20     //above this a cell counts as solid
+
+signed char Occ_Map[MAP_N][MAP_N];
+double Sonar_Last[36];
+double Sonar_DX[36],Sonar_DY[36];
+bool Occ_Init=false,Sonar_Fresh=false;
+int Sonar_Age=0,Sonar_Period=10;//steps since the last ping, steps between pings
+double Sonar_Range=0;//longest echo seen, taken as the sonar's reach
+int Occ_Changed=0;//bumped whenever a cell turns solid or clears
+
+int Occ_Cell(double p){
+    int c=(int)floor(p/MAP_CELL);
+    if(c<0) return -1;
+    if(c>=MAP_N) return -1;
+    return c;
+}
+
+bool Occ_Solid(int cx,int cy){
+    if(cx<0||cy<0||cx>=MAP_N||cy>=MAP_N) return true;//outside the map
+    return Occ_Map[cy][cx]>LO_OCC;
+}
+
+void Occ_Add(int cx,int cy,int d){
+    if(cx<0||cy<0||cx>=MAP_N||cy>=MAP_N) return;
+    int v=Occ_Map[cy][cx]+d;
+    if(v>LO_MAX) v=LO_MAX;
+    if(v<-LO_MAX) v=-LO_MAX;
+    if((v>LO_OCC)!=(Occ_Map[cy][cx]>LO_OCC)) Occ_Changed++;
+    Occ_Map[cy][cx]=(signed char)v;
+}
+
+void Occ_Update(void){
+    //Sonar index i points i*10 degrees clockwise from straight up,
+    //map y grows downward.
+    if(!Occ_Init){
+        for(int i=0;i<36;i++){
+            Sonar_DX[i]=sin(i*10*PI/180);
+            Sonar_DY[i]=-cos(i*10*PI/180);
+            Sonar_Last[i]=-2;
         }
-        Left_Thruster(0);
-        Right_Thruster(power);
-    } else {
-        // LT and MT is fail
-        stay_X_degree(360-90);
-        if(Angle()>340 && Angle()<255){
-            Right_Thruster(0);
-            Left_Thruster(0);
-            return;
+        for(int y=0;y<MAP_N;y++)
+            for(int x=0;x<MAP_N;x++) Occ_Map[y][x]=0;
+        Occ_Init=true;
+    }
+
+    //Readings stay the same between sonar updates, only add a ping once
+    Sonar_Fresh=false;
+    Sonar_Age++;
+    for(int i=0;i<36;i++)
+        if(SONAR_DIST[i]!=Sonar_Last[i]) Sonar_Fresh=true;
+    if(!Sonar_Fresh) return;
+    Sonar_Period=Sonar_Age;
+    Sonar_Age=0;
+    for(int i=0;i<36;i++)
+        if(SONAR_DIST[i]>Sonar_Range) Sonar_Range=SONAR_DIST[i];
+    for(int i=0;i<36;i++) Sonar_Last[i]=SONAR_DIST[i];
+
+    //Without a position fix the pings would be drawn in the wrong place,
+    //freeze the map and let the particle filter use it instead
+    if(!X_OK || !Y_OK) return;
+
+    //Half a cell per sample so no cell along the ray is skipped
+    double step=MAP_CELL*0.5;
+    for(int i=0;i<36;i++){
+        double d=SONAR_DIST[i];
+        if(d<0) continue;//no echo, range unknown
+        int ns=(int)(d/step);
+        int lx=-1,ly=-1;
+        for(int s=0;s<ns;s++){
+            int cx=Occ_Cell(Position_X_N+Sonar_DX[i]*s*step);
+            int cy=Occ_Cell(Position_Y_N+Sonar_DY[i]*s*step);
+            if(cx==lx && cy==ly) continue;
+            Occ_Add(cx,cy,-LO_MISS);
+            lx=cx;
+            ly=cy;
         }
-        Right_Thruster(0);
-        Left_Thruster(power);
+        Occ_Add(Occ_Cell(Position_X_N+Sonar_DX[i]*d),Occ_Cell(Position_Y_N+Sonar_DY[i]*d),LO_HIT);
+    }
+}
+
+//Distance (pixels) we can travel from (x,y) towards 'deg' (clockwise
+//from up) before entering a solid cell, capped at maxd.
+double Occ_Clearance(double x,double y,double deg,double maxd){
+    double dx=sin(deg*PI/180),dy=-cos(deg*PI/180);
+    double step=MAP_CELL*0.5;
+    for(double s=0;s<maxd;s+=step){
+        int cx=(int)floor((x+dx*s)/MAP_CELL);
+        int cy=(int)floor((y+dy*s)/MAP_CELL);
+        if(Occ_Solid(cx,cy)) return s;
     }
-    return;
+    return maxd;
+}
+
+//Cells the platform itself shows up in, we are meant to touch those
+#define PLAT_HALF 30.0   //pixels, half the platform's width
+#define OCC_PAD (PLAT_HALF+MAP_CELL/2) //cell centres this close to PLAT_X overlap it
+
+bool Occ_Pad(int cx,int cy){
+    return fabs((cx+0.5)*MAP_CELL-PLAT_X)<OCC_PAD && fabs((cy+0.5)*MAP_CELL-PLAT_Y)<2*MAP_CELL;
+}
+
+//True if a lander of radius 'r' pixels can fly straight from (x0,y0) to
+//(x1,y1) without touching a known solid cell. The cells around both ends
+//are not checked: we are already at the start, and the end may be on the
+//platform. Platform cells never block.
+bool Occ_Free_Corridor(double x0,double y0,double x1,double y1,double r){
+    double len=sqrt((x1-x0)*(x1-x0)+(y1-y0)*(y1-y0));
+    double step=MAP_CELL*0.5;
+    int rc=(int)ceil(r/MAP_CELL);
+    int sx=(int)floor(x0/MAP_CELL),sy=(int)floor(y0/MAP_CELL);
+    int ex=(int)floor(x1/MAP_CELL),ey=(int)floor(y1/MAP_CELL);
+    for(double s=0;s<len;s+=step){
+        int cx=(int)floor((x0+(x1-x0)*s/len)/MAP_CELL);
+        int cy=(int)floor((y0+(y1-y0)*s/len)/MAP_CELL);
+        if(abs(cx-ex)<=rc && abs(cy-ey)<=rc) break;
+        if(abs(cx-sx)<=rc && abs(cy-sy)<=rc) continue;
+        for(int j=-rc;j<=rc;j++)
+            for(int i=-rc;i<=rc;i++)
+                if(Occ_Solid(cx+i,cy+j) && !Occ_Pad(cx+i,cy+j)) return false;
+    }
+    return true;
+}
+
+//Distance (pixels) from every cell to the nearest solid cell. With this
+//table a sonar echo is scored by looking up where it ended, instead of
+//casting a ray through the grid for each particle and each beam.
+float Occ_Dist[MAP_N][MAP_N];
+int Occ_Dist_Stamp=-1;
+
+void Occ_Distance_Field(void){
+    if(Occ_Dist_Stamp==Occ_Changed) return;//grid has not changed
+    const float big=1e9,d1=MAP_CELL,d2=MAP_CELL*1.41421356;
+    for(int y=0;y<MAP_N;y++)
+        for(int x=0;x<MAP_N;x++)
+            Occ_Dist[y][x]=Occ_Map[y][x]>LO_OCC ? 0 : big;
+
+    //Two pass chamfer distance transform
+    for(int y=0;y<MAP_N;y++)
+        for(int x=0;x<MAP_N;x++){
+            float d=Occ_Dist[y][x];
+            if(x>0) d=fminf(d,Occ_Dist[y][x-1]+d1);
+            if(y>0){
+                d=fminf(d,Occ_Dist[y-1][x]+d1);
+                if(x>0) d=fminf(d,Occ_Dist[y-1][x-1]+d2);
+                if(x<MAP_N-1) d=fminf(d,Occ_Dist[y-1][x+1]+d2);
+            }
+            Occ_Dist[y][x]=d;
+        }
+    for(int y=MAP_N-1;y>=0;y--)
+        for(int x=MAP_N-1;x>=0;x--){
+            float d=Occ_Dist[y][x];
+            if(x<MAP_N-1) d=fminf(d,Occ_Dist[y][x+1]+d1);
+            if(y<MAP_N-1){
+                d=fminf(d,Occ_Dist[y+1][x]+d1);
+                if(x<MAP_N-1) d=fminf(d,Occ_Dist[y+1][x+1]+d2);
+                if(x>0) d=fminf(d,Occ_Dist[y+1][x-1]+d2);
+            }
+            Occ_Dist[y][x]=d;
+        }
+    Occ_Dist_Stamp=Occ_Changed;
+}
+
+double Occ_Distance(double x,double y){
+    int cx=(int)floor(x/MAP_CELL),cy=(int)floor(y/MAP_CELL);
+    if(cx<0||cy<0||cx>=MAP_N||cy>=MAP_N) return MAP_N*MAP_CELL;//nothing known out there
+    return Occ_Dist[cy][cx];
 }
 
 double last_d=40;//land distance
 
+//********************Path Planner*******************//
+
+//Flying straight at the platform and letting Safety_Override() bounce
+//us off the terrain gives long detours on hard maps. When the straight
+//line to the approach point (above the platform) is blocked in the
+//occupancy grid, plan around it with A*. Steps near terrain cost more,
+//so the route keeps clear of it. Cells never seen count as free. The
+//route is kept until a new solid cell blocks it or we stray from it.
+//When there is no route, don't search again until the grid changes or
+//we move to another cell, the answer would be the same.
+#define PATH_R 12.0      //pixels, cells closer than this to terrain are blocked
+#define PATH_APPROACH 100.0 //pixels above the platform where the route ends
+#define PATH_MAX (MAP_N*MAP_N)
+
+bool Path_On=false;//set to true to plan around mapped terrain
+
+int Path_Cell[PATH_MAX],Path_Len=0,Path_Stamp=-1,Path_Age=0;
+int Path_Fail_Stamp=-1,Path_Fail_Cell=-1;//grid and start of the last failed search
+float Path_G[MAP_N*MAP_N];
+int Path_From[MAP_N*MAP_N],Path_Heap[MAP_N*MAP_N],Path_Heap_n=0;
+float Path_F[MAP_N*MAP_N];
+unsigned char Path_Closed[MAP_N*MAP_N];
+
+void Path_Push(int c){
+    int i=Path_Heap_n++;
+    while(i>0 && Path_F[Path_Heap[(i-1)/2]]>Path_F[c]){
+        Path_Heap[i]=Path_Heap[(i-1)/2];
+        i=(i-1)/2;
+    }
+    Path_Heap[i]=c;
+}
+
+int Path_Pop(void){
+    int top=Path_Heap[0],last=Path_Heap[--Path_Heap_n],i=0;
+    while(2*i+1<Path_Heap_n){
+        int k=2*i+1;
+        if(k+1<Path_Heap_n && Path_F[Path_Heap[k+1]]<Path_F[Path_Heap[k]]) k++;
+        if(Path_F[Path_Heap[k]]>=Path_F[last]) break;
+        Path_Heap[i]=Path_Heap[k];
+        i=k;
+    }
+    Path_Heap[i]=last;
+    return top;
+}
+
+bool Path_Blocked(int cx,int cy){
+    if(cx<0||cy<0||cx>=MAP_N||cy>=MAP_N) return true;
+    //stay above the band where Lander_Control() starts landing
+    if((cy+1)*MAP_CELL>PLAT_Y-last_d) return true;
+    return Occ_Dist[cy][cx]<PATH_R;
+}
+
+bool Path_Plan(double x0,double y0,double x1,double y1){
+    Occ_Distance_Field();
+    int sx=(int)floor(x0/MAP_CELL),sy=(int)floor(y0/MAP_CELL);
+    int gx=(int)floor(x1/MAP_CELL),gy=(int)floor(y1/MAP_CELL);
+    Path_Len=0;
+    if(sx<0||sy<0||sx>=MAP_N||sy>=MAP_N) return false;
+    if(gx<0||gy<0||gx>=MAP_N||gy>=MAP_N) return false;
+    for(int c=0;c<MAP_N*MAP_N;c++){
+        Path_G[c]=1e30;
+        Path_Closed[c]=0;
+    }
+    int s0=sy*MAP_N+sx,goal=gy*MAP_N+gx;
+    Path_G[s0]=0;
+    Path_F[s0]=hypot(gx-sx,gy-sy);
+    Path_From[s0]=-1;
+    Path_Heap_n=0;
+    Path_Push(s0);
+    while(Path_Heap_n>0){
+        int c=Path_Pop();
+        if(Path_Closed[c]) continue;
+        Path_Closed[c]=1;
+        if(c==goal) break;
+        int cx=c%MAP_N,cy=c/MAP_N;
+        for(int dy=-1;dy<=1;dy++)
+            for(int dx=-1;dx<=1;dx++){
+                if(!dx && !dy) continue;
+                int nx=cx+dx,ny=cy+dy,nc=ny*MAP_N+nx;
+                //the approach point may be tight, still head for it
+                if(Path_Blocked(nx,ny) && nc!=goal) continue;
+                if(Path_Closed[nc]) continue;
+                double len=(dx&&dy) ? 1.41421356 : 1;
+                double g=Path_G[c]+len*(1+4*MAP_CELL/(Occ_Dist[ny][nx]+MAP_CELL));
+                if(g<Path_G[nc]){
+                    Path_G[nc]=g;
+                    Path_From[nc]=c;
+                    Path_F[nc]=g+hypot(gx-nx,gy-ny);
+                    Path_Push(nc);
+                }
+            }
+    }
+    if(!Path_Closed[goal]) return false;
+    //Walk back from the goal, then flip so the route starts at us
+    for(int c=goal;c!=-1;c=Path_From[c]) Path_Cell[Path_Len++]=c;
+    for(int i=0;i<Path_Len/2;i++){
+        int t=Path_Cell[i];
+        Path_Cell[i]=Path_Cell[Path_Len-1-i];
+        Path_Cell[Path_Len-1-i]=t;
+    }
+    Path_Stamp=Occ_Changed;
+    Path_Age=0;
+    printf("Path: %d cells\n",Path_Len);
+    return true;
+}
+
+//Index of the route cell closest to (x,y), and how far it is (cells)
+int Path_Nearest(double x,double y,double *dist){
+    int best=0;
+    double bd=1e30;
+    for(int i=0;i<Path_Len;i++){
+        double dx=Path_Cell[i]%MAP_N+0.5-x/MAP_CELL,dy=Path_Cell[i]/MAP_N+0.5-y/MAP_CELL;
+        if(dx*dx+dy*dy<bd){
+            bd=dx*dx+dy*dy;
+            best=i;
+        }
+    }
+    *dist=sqrt(bd);
+    return best;
+}
+
+//Fly the route while the direct line is blocked. Returns false when the
+//normal controller should fly (direct line clear, or no route found).
+bool Path_Control(void){
+    double ax=PLAT_X,ay=PLAT_Y-PATH_APPROACH;
+    //Over the platform or landing: the normal controller brings us down
+    if(fabs(PLAT_X-Position_X_N)<OCC_PAD || fabs(PLAT_Y-Position_Y_N)<last_d){
+        Path_Len=0;
+        return false;
+    }
+    if(Occ_Free_Corridor(Position_X_N,Position_Y_N,ax,ay,PATH_R)){
+        Path_Len=0;
+        return false;
+    }
+
+    double off=0;
+    int at=Path_Len ? Path_Nearest(Position_X_N,Position_Y_N,&off) : 0;
+    bool blocked=false;
+    if(Path_Len && Path_Stamp!=Occ_Changed){
+        Occ_Distance_Field();
+        for(int i=at;i<Path_Len && !blocked;i++)
+            blocked=Path_Blocked(Path_Cell[i]%MAP_N,Path_Cell[i]/MAP_N);
+        if(!blocked) Path_Stamp=Occ_Changed;
+    }
+    Path_Age++;
+    if(!Path_Len || blocked || (off>4 && Path_Age>20)){
+        int cell=(int)floor(Position_Y_N/MAP_CELL)*MAP_N+(int)floor(Position_X_N/MAP_CELL);
+        if(Path_Fail_Stamp==Occ_Changed && Path_Fail_Cell==cell) return false;
+        if(!Path_Plan(Position_X_N,Position_Y_N,ax,ay)){
+            Path_Fail_Stamp=Occ_Changed;
+            Path_Fail_Cell=cell;
+            return false;
+        }
+        at=0;
+    }
+
+    //Aim at the furthest route cell we can see, a few cells ahead
+    int w=at;
+    for(int i=at+1;i<Path_Len && i<=at+8;i++){
+        double wx=(Path_Cell[i]%MAP_N+0.5)*MAP_CELL,wy=(Path_Cell[i]/MAP_N+0.5)*MAP_CELL;
+        if(!Occ_Free_Corridor(Position_X_N,Position_Y_N,wx,wy,PATH_R*0.5)) break;
+        w=i;
+    }
+    double wx=(Path_Cell[w]%MAP_N+0.5)*MAP_CELL,wy=(Path_Cell[w]/MAP_N+0.5)*MAP_CELL;
+
+    //Speed towards the waypoint (m/s, y up), slower when close
+    double dx=wx-Position_X_N,dy=Position_Y_N-wy,d=sqrt(dx*dx+dy*dy)+1e-6;
+    double sp=fmin(15,d/5);
+    double vxd=sp*dx/d,vyd=sp*dy/d;
+
+    if(Velocity_X_N<vxd-1) Robust_Left_Thruster((vxd-Velocity_X_N)/5);
+    else if(Velocity_X_N>vxd+1) Robust_Right_Thruster((Velocity_X_N-vxd)/5);
+    else Robust_Thrust_X(0);
+    if(Velocity_Y_N<vyd) Robust_Main_Thruster(1.0);
+    else Robust_Main_Thruster(0);
+    return true;
+}
+
+//********************Particle Filter*******************//
+
+//Once a position sensor fails, dead reckoning drifts without bound.
+//Track a cloud of candidate positions instead, move them with the
+//velocity estimate and keep the ones whose expected sonar ranges
+//(looked up in the occupancy grid) match what the sonar reports.
+#define NPART 300
+#define PF_SPREAD 10.0   //pixels, initial spread around the last good fix
+#define PF_MOVE 0.3      //pixels per tick of motion noise
+#define PF_SIGMA 12.0    //pixels, sonar range error we tolerate
+
+double PF_X[NPART],PF_Y[NPART],PF_W[NPART];
+double PF_Est_X=0,PF_Est_Y=0;
+bool PF_On=false;
+
+//Random numbers come from a hash of (seed, tick, particle, channel)
+//rather than drand48(). The simulator draws its own noise from the same
+//drand48() stream, so every draw here used to change the noise of the
+//rest of the flight; now a flight is reproducible whether or not the
+//filter runs, and any particle's draws can be recomputed on their own.
+#define PF_SEED 0x4c616e646572ULL
+#define PF_CH_START 0    //channels, two numbers each
+#define PF_CH_MOVE 2
+#define PF_CH_RESAMPLE 4
+#define PF_CH_RESEED 6
+unsigned long long PF_Tick=0;
+
+unsigned long long PF_Mix(unsigned long long z){
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    return z^(z>>31);
+}
+
+//Uniform in (0,1)
+double PF_Uniform(int i,int ch){
+    unsigned long long z=PF_Mix(PF_SEED+PF_Tick*0x9e3779b97f4a7c15ULL);
+    z=PF_Mix(z^((unsigned long long)i<<8|ch));
+    return ((z>>11)+0.5)/9007199254740992.0;
+}
+
+double PF_Gauss(int i,int ch){
+    double u=PF_Uniform(i,ch),v=PF_Uniform(i,ch+1);
+    return sqrt(-2*log(u))*cos(2*PI*v);
+}
+
+//Sonar signature table: the 36 ranges we would expect at each point of
+//a coarse grid, cast once through the occupancy grid when the filter
+//starts (mapping is frozen from then on). On each ping the table is
+//searched for the position whose signature best matches SONAR_DIST. If
+//it fits much better than where the cloud is, part of the cloud is moved
+//there. The sonar is fixed to the map and not to the lander, so the
+//signature does not depend on the angle and there is no angle axis.
+#define SIG_STEP 2       //grid cells between table positions
+#define SIG_N (MAP_N/SIG_STEP)
+#define SIG_NONE 0xffff  //no echo expected
+#define SIG_RESEED 10    //every SIG_RESEED-th particle may be moved
+
+unsigned short Sig_Table[SIG_N][SIG_N][36];
+bool Sig_Ok[SIG_N][SIG_N];//position seen free, worth matching
+bool Sig_Built=false;
+
+//Expected ranges at (x,y)
+void Sig_Cast(double x,double y,unsigned short *sig){
+    for(int r=0;r<36;r++){
+        double d=Occ_Clearance(x,y,r*10,Sonar_Range);
+        sig[r]=d>=Sonar_Range ? SIG_NONE : (unsigned short)d;
+    }
+}
+
+void Sig_Build(void){
+    Sig_Built=false;
+    if(Sonar_Range<=0) return;//no echo yet, nothing to match
+    Occ_Distance_Field();
+    for(int sy=0;sy<SIG_N;sy++)
+        for(int sx=0;sx<SIG_N;sx++){
+            int cx=sx*SIG_STEP,cy=sy*SIG_STEP;
+            double x=(cx+SIG_STEP*0.5)*MAP_CELL,y=(cy+SIG_STEP*0.5)*MAP_CELL;
+            Sig_Ok[sy][sx]=Occ_Map[cy][cx]<0 && Occ_Dist[cy][cx]>=MAP_CELL;
+            if(Sig_Ok[sy][sx]) Sig_Cast(x,y,Sig_Table[sy][sx]);
+        }
+    Sig_Built=true;
+}
+
+//Squared mismatch between the ping and a signature, stops counting once
+//it passes 'stop'
+double Sig_Error(const unsigned short *sig,double stop){
+    double e2=0,cap=3*PF_SIGMA;
+    for(int r=0;r<36 && e2<stop;r++){
+        unsigned short t=sig[r];
+        double e;
+        if(SONAR_DIST[r]<0) e=t==SIG_NONE ? 0 : cap;
+        else e=t==SIG_NONE ? cap : fmin(fabs(SONAR_DIST[r]-t),cap);
+        e2+=e*e;
+    }
+    return e2;
+}
+
+//Best matching table position for the current ping. An axis whose
+//sensor still works only leaves the table entries next to its reading.
+double Sig_Match(double *x,double *y){
+    double best=1e30,near=SIG_STEP*MAP_CELL;
+    for(int sy=0;sy<SIG_N;sy++)
+        for(int sx=0;sx<SIG_N;sx++){
+            if(!Sig_Ok[sy][sx]) continue;
+            if(X_OK && fabs((sx*SIG_STEP+SIG_STEP*0.5)*MAP_CELL-Position_X_N)>near) continue;
+            if(Y_OK && fabs((sy*SIG_STEP+SIG_STEP*0.5)*MAP_CELL-Position_Y_N)>near) continue;
+            double e=Sig_Error(Sig_Table[sy][sx],best);
+            if(e<best){
+                best=e;
+                *x=(sx*SIG_STEP+SIG_STEP*0.5)*MAP_CELL;
+                *y=(sy*SIG_STEP+SIG_STEP*0.5)*MAP_CELL;
+            }
+        }
+    return best;
+}
+
+//Move some particles to the best table match if the cloud fits badly
+void PF_Reanchor(void){
+    if(!Sig_Built) return;
+    double bx=0,by=0,best=Sig_Match(&bx,&by);
+    if(best>36*PF_SIGMA*PF_SIGMA) return;//nothing fits well
+    if(X_OK) bx=Position_X_N;
+    if(Y_OK) by=Position_Y_N;
+    unsigned short sig[36];
+    Sig_Cast(PF_Est_X,PF_Est_Y,sig);
+    double here=Sig_Error(sig,1e30);
+    if(here<4*best || hypot(bx-PF_Est_X,by-PF_Est_Y)<2*SIG_STEP*MAP_CELL) return;
+    printf("Particle filter: re-anchor at %f %f\n",bx,by);
+    double sum=0;
+    for(int i=0;i<NPART;i++){
+        if(i%SIG_RESEED==0){
+            PF_X[i]=bx+PF_Gauss(i,PF_CH_RESEED)*PF_SPREAD;
+            PF_Y[i]=by+PF_Gauss(i+NPART,PF_CH_RESEED)*PF_SPREAD;
+            PF_W[i]=1.0/NPART;
+        }
+        sum+=PF_W[i];
+    }
+    for(int i=0;i<NPART;i++) PF_W[i]/=sum;
+}
+
+void PF_Start(double x,double y){
+    for(int i=0;i<NPART;i++){
+        PF_X[i]=x+PF_Gauss(i,PF_CH_START)*PF_SPREAD;
+        PF_Y[i]=y+PF_Gauss(i+NPART,PF_CH_START)*PF_SPREAD;
+        PF_W[i]=1.0/NPART;
+    }
+    PF_Est_X=x;
+    PF_Est_Y=y;
+    PF_On=true;
+    Sig_Build();
+    printf("Particle filter: start at %f %f\n",x,y);
+}
+
+double PF_Score(double x,double y){
+    //Each echo should end on something solid; the further its end point
+    //is from the nearest known solid cell, the worse the particle.
+    //Errors are capped so terrain we have not mapped yet does not wipe
+    //out the right particles.
+    double e2=0,cap=3*PF_SIGMA;
+    for(int r=0;r<36;r++){
+        if(SONAR_DIST[r]<0) continue;
+        double e=Occ_Distance(x+Sonar_DX[r]*SONAR_DIST[r],y+Sonar_DY[r]*SONAR_DIST[r]);
+        if(e>cap) e=cap;
+        e2+=e*e;
+    }
+    return exp(-e2/(2*PF_SIGMA*PF_SIGMA*36));
+}
+
+void PF_Resample(void){
+    //Systematic resampling, one random draw for the whole cloud
+    double nx[NPART],ny[NPART];
+    double u=PF_Uniform(0,PF_CH_RESAMPLE)/NPART,c=PF_W[0];
+    int j=0;
+    for(int i=0;i<NPART;i++){
+        while(u>c && j<NPART-1){
+            j++;
+            c+=PF_W[j];
+        }
+        nx[i]=PF_X[j];
+        ny[i]=PF_Y[j];
+        u+=1.0/NPART;
+    }
+    for(int i=0;i<NPART;i++){
+        PF_X[i]=nx[i];
+        PF_Y[i]=ny[i];
+        PF_W[i]=1.0/NPART;
+    }
+}
+
+void PF_Step(void){
+    //Velocity is in m/s with y up, the map is in pixels with y down
+    double dx=Velocity_X_N*T_STEP*S_SCALE;
+    double dy=-Velocity_Y_N*T_STEP*S_SCALE;
+    for(int i=0;i<NPART;i++){
+        PF_X[i]+=dx+PF_Gauss(i,PF_CH_MOVE)*PF_MOVE;
+        PF_Y[i]+=dy+PF_Gauss(i+NPART,PF_CH_MOVE)*PF_MOVE;
+        //a working axis pins the particles to the sensor
+        if(X_OK) PF_X[i]=Position_X_N;
+        if(Y_OK) PF_Y[i]=Position_Y_N;
+    }
+
+    if(Sonar_Fresh){
+        Occ_Distance_Field();
+        double sum=0;
+        for(int i=0;i<NPART;i++){
+            PF_W[i]*=PF_Score(PF_X[i],PF_Y[i]);
+            sum+=PF_W[i];
+        }
+        if(sum<1e-300){
+            //nothing fits, keep the cloud and trust the motion model
+            for(int i=0;i<NPART;i++) PF_W[i]=1.0/NPART;
+        }else{
+            double neff=0;
+            for(int i=0;i<NPART;i++){
+                PF_W[i]/=sum;
+                neff+=PF_W[i]*PF_W[i];
+            }
+            if(1.0/neff<NPART/2) PF_Resample();
+        }
+        PF_Reanchor();
+    }
+
+    PF_Est_X=0;
+    PF_Est_Y=0;
+    for(int i=0;i<NPART;i++){
+        PF_Est_X+=PF_W[i]*PF_X[i];
+        PF_Est_Y+=PF_W[i]*PF_Y[i];
+    }
+    PF_Tick++;
+}
+
+//********************Policy Table*******************//
+
+//Vertical descent policy from value iteration. The state is the height
+//above the platform (pixels) and the vertical speed; the action is full
+//upward thrust or nothing; the cost is time to touchdown. Any state in
+//the last last_d pixels that comes down faster than POL_VTD counts as a
+//crash, so the lander arrives slowly whatever the exact contact height.
+//The solved policy is a switching curve, so only the switching speed
+//for each height is kept (one float per row), and queries interpolate
+//it. Table 0 is for the main thruster, table 1 for a side thruster
+//turned to push up.
+#define POL_NH 251       //heights 0..1000 pixels
+#define POL_HS 4.0
+#define POL_NV 121       //speeds -50..10 m/s
+#define POL_VMIN -50.0
+#define POL_VS 0.5
+#define POL_DT 0.05
+#define POL_VTD -3.0     //fastest descent allowed near the platform
+#define POL_VX_LAND 1.0  //m/s, drift allowed when leaving the hold above the platform
+#define POL_LEAN 4.0     //degrees, most the main thruster leans in the landing band
+#define POL_BIG 1e6
+
+bool Policy_On=false;//set to true to fly the vertical axis from the table
+
+float Pol_Switch[2][POL_NH];//thrust when vertical speed is below this
+bool Pol_Init=false;
+
+double Pol_Value(float V[POL_NH][POL_NV],double h,double v){
+    double fh=h/POL_HS,fv=(v-POL_VMIN)/POL_VS;
+    if(fv<0) return POL_BIG;//faster than the table, too late anyway
+    if(fh>POL_NH-1) fh=POL_NH-1;
+    if(fv>POL_NV-1) fv=POL_NV-1;
+    int i=(int)fh,j=(int)fv;
+    if(i>POL_NH-2) i=POL_NH-2;
+    if(j>POL_NV-2) j=POL_NV-2;
+    double a=fh-i,b=fv-j;
+    return (1-a)*((1-b)*V[i][j]+b*V[i][j+1])+a*((1-b)*V[i+1][j]+b*V[i+1][j+1]);
+}
+
+//Cost of one step from (h,v) with upward acceleration 'up'
+double Pol_Step(float V[POL_NH][POL_NV],double h,double v,double up){
+    double v2=v+(up-G_ACCEL)*POL_DT;
+    double h2=h+(v+v2)/2*POL_DT*S_SCALE;
+    if(h2<=last_d && v2<POL_VTD) return POL_BIG;
+    if(h2<=0) return POL_DT;//touched down slowly enough
+    return POL_DT+Pol_Value(V,h2,v2);
+}
+
+void Policy_Build(void){
+    static float V[POL_NH][POL_NV];
+    double up[2]={MT_ACCEL,LT_ACCEL};
+    for(int t=0;t<2;t++){
+        for(int i=0;i<POL_NH;i++)
+            for(int j=0;j<POL_NV;j++) V[i][j]=POL_BIG;
+        //Sweep from the ground up so each pass carries values a long way
+        for(int it=0;it<400;it++){
+            double change=0;
+            for(int i=0;i<POL_NH;i++)
+                for(int j=0;j<POL_NV;j++){
+                    double h=i*POL_HS,v=POL_VMIN+j*POL_VS;
+                    double q=fmin(Pol_Step(V,h,v,0),Pol_Step(V,h,v,up[t]));
+                    if(q>POL_BIG) q=POL_BIG;
+                    if(fabs(q-V[i][j])>change) change=fabs(q-V[i][j]);
+                    V[i][j]=q;
+                }
+            if(change<1e-4) break;
+        }
+        //Keep only where the policy switches from thrust to coasting
+        for(int i=0;i<POL_NH;i++){
+            double h=i*POL_HS;
+            Pol_Switch[t][i]=POL_VMIN;
+            for(int j=0;j<POL_NV;j++){
+                double v=POL_VMIN+j*POL_VS;
+                if(Pol_Step(V,h,v,up[t])<Pol_Step(V,h,v,0)) Pol_Switch[t][i]=v+POL_VS;
+            }
+        }
+    }
+    Pol_Init=true;
+}
+
+//True if we should be pushing up at height h (pixels) and speed v (m/s)
+bool Policy_Up(double h,double v){
+    if(!Pol_Init) Policy_Build();
+    int t=MT_OK_N ? 0 : 1;
+    double fh=fmax(0,fmin(h/POL_HS,POL_NH-1.001));
+    int i=(int)fh;
+    double a=fh-i;
+    return v<(1-a)*Pol_Switch[t][i]+a*Pol_Switch[t][i+1];
+}
+
+//********************MPC*******************//
+
+//Predictive mode: instead of the fixed VXlim/VYlim steps, try a few
+//hundred thrust plans every tick, fly each one forward with the known
+//dynamics and keep the best. A plan is two 0.5s segments, each with a
+//main thruster power and a side thrust (+ left thruster, - right).
+//Only used while upright with all thrusters working, otherwise the
+//normal controller flies.
+#define MPC_NM 5         //main thruster levels per segment
+#define MPC_NL 5         //side thrust levels per segment
+#define MPC_NC (MPC_NM*MPC_NL*MPC_NM*MPC_NL)
+#define MPC_DT 0.05      //seconds per rollout step
+#define MPC_SEG 10       //rollout steps per segment
+
+bool MPC_On=false;//set to true to fly with the predictive controller
+
+//Main thruster levels, dense around hover (G_ACCEL/MT_ACCEL = .25)
+double MPC_Main_Level[MPC_NM]={0,0.2,0.3,0.45,1};
+
+double MPC_M[2][MPC_NC],MPC_L[2][MPC_NC];
+double MPC_X[MPC_NC],MPC_Y[MPC_NC],MPC_VX[MPC_NC],MPC_VY[MPC_NC],MPC_J[MPC_NC];
+int MPC_Done[MPC_NC];
+bool MPC_Init=false;
+
+void MPC_Build(void){
+    int c=0;
+    for(int m0=0;m0<MPC_NM;m0++)
+        for(int l0=0;l0<MPC_NL;l0++)
+            for(int m1=0;m1<MPC_NM;m1++)
+                for(int l1=0;l1<MPC_NL;l1++){
+                    MPC_M[0][c]=MPC_Main_Level[m0];
+                    MPC_L[0][c]=l0/((MPC_NL-1)/2.0)-1;
+                    MPC_M[1][c]=MPC_Main_Level[m1];
+                    MPC_L[1][c]=l1/((MPC_NL-1)/2.0)-1;
+                    c++;
+                }
+    MPC_Init=true;
+}
+
+//Returns false when the normal controller should fly instead
+bool MPC_Control(void){
+    if(!MT_OK_N || !LT_OK_N || !RT_OK_N) return false;
+    if(fabs(Angle_Diff(0,TH_Position_N))>5) return false;
+    if(!MPC_Init) MPC_Build();
+
+    //Braking power left over after gravity, used to judge end states
+    double brake_y=MT_ACCEL-G_ACCEL,brake_x=LT_ACCEL;
+
+    for(int c=0;c<MPC_NC;c++){
+        MPC_X[c]=Position_X_N;
+        MPC_Y[c]=Position_Y_N;
+        MPC_VX[c]=Velocity_X_N;
+        MPC_VY[c]=Velocity_Y_N;
+        MPC_J[c]=0;
+        MPC_Done[c]=0;
+    }
+
+    for(int k=0;k<2*MPC_SEG;k++){
+        int g=k/MPC_SEG;
+        //Plain arrays and no branches, so the compiler can vectorise this
+        for(int c=0;c<MPC_NC;c++){
+            double run=MPC_Done[c] ? 0 : 1;
+            MPC_VX[c]+=run*MPC_L[g][c]*LT_ACCEL*MPC_DT;
+            MPC_VY[c]+=run*(MPC_M[g][c]*MT_ACCEL-G_ACCEL)*MPC_DT;
+            MPC_X[c]+=run*MPC_VX[c]*MPC_DT*S_SCALE;
+            MPC_Y[c]-=run*MPC_VY[c]*MPC_DT*S_SCALE;//map y grows downward
+        }
+        for(int c=0;c<MPC_NC;c++){
+            if(MPC_Done[c]) continue;
+            if(MPC_Y[c]>=PLAT_Y-last_d){
+                //Close to touchdown: be over the platform, slow and level
+                if(fabs(MPC_X[c]-PLAT_X)>25) MPC_J[c]+=1e6;
+                if(MPC_VY[c]<-3.5) MPC_J[c]+=1e4*(-3.5-MPC_VY[c]);
+                if(fabs(MPC_VX[c])>1) MPC_J[c]+=100*(fabs(MPC_VX[c])-1);
+                if(MPC_Y[c]>=PLAT_Y) MPC_Done[c]=1;
+                continue;
+            }
+            //Known terrain along the way, every few steps
+            if(k%3==2 && fabs(MPC_X[c]-PLAT_X)>40 &&
+               Occ_Solid((int)floor(MPC_X[c]/MAP_CELL),(int)floor(MPC_Y[c]/MAP_CELL))){
+                MPC_J[c]+=1e6;
+                MPC_Done[c]=1;
+            }
+        }
+    }
+
+    int best=0;
+    for(int c=0;c<MPC_NC;c++){
+        if(!MPC_Done[c]){
+            //End state: distance left, plus whatever we could not stop in time
+            double dx=PLAT_X-MPC_X[c],h=fmax(0,PLAT_Y-last_d-MPC_Y[c]);
+            double down=fmax(0,-MPC_VY[c]);
+            double stop_y=fmax(0,down*down-16)/(2*brake_y)*S_SCALE;
+            double stop_x=MPC_VX[c]*MPC_VX[c]/(2*brake_x)*S_SCALE;
+            MPC_J[c]+=fabs(dx)+(PLAT_Y-MPC_Y[c]);
+            if(stop_y>0.8*h) MPC_J[c]+=100*(stop_y-0.8*h);
+            if(dx*MPC_VX[c]>0 && stop_x>fabs(dx)) MPC_J[c]+=10*(stop_x-fabs(dx));
+            if(dx*MPC_VX[c]<0) MPC_J[c]+=stop_x;
+            //Do not come down before we are over the platform
+            if(fabs(dx)>50 && h<100) MPC_J[c]+=10*(100-h);
+        }
+        if(MPC_J[c]<MPC_J[best]) best=c;
+    }
+    if(MPC_J[best]>=1e6) return false;//every plan hits something
+
+    Fire_Main(MPC_M[0][best]);
+    if(MPC_L[0][best]>0){
+        Fire_Right(0);
+        Fire_Left(MPC_L[0][best]);
+    }else{
+        Fire_Left(0);
+        Fire_Right(-MPC_L[0][best]);
+    }
+    stay_X_degree(0);
+    return true;
+}
+
+//********************Safety Envelope*******************//
+
+//Stopping distance table for Safety_Override(). For each set of working
+//thrusters and each direction of motion, fly the override's own brake
+//(turn to the allocation attitude, then full thrust) from every speed
+//bin once at startup and keep the distance covered before the speed
+//along that direction reaches zero. Per tick it is one lookup plus the
+//extra turning from the current attitude.
+#define ENV_NV 121       //speed bins
+#define ENV_VS 0.5       //m/s per bin
+#define ENV_TMAX 4000    //give up after this many steps (20s)
+#define ENV_HALF 32      //pixels, half the 64x64 lander, sonar ranges are from its centre
+#define ENV_MARGIN 20    //pixels kept between the hull and the surface
+#define ENV_RIGHT 0
+#define ENV_LEFT 1
+#define ENV_UP 2
+#define ENV_DOWN 3
+
+double Env_Stop[8][4][ENV_NV];//pixels, -1: cannot stop that way
+double Env_Att[8][4],Env_Turn[8][4];
+bool Env_Init=false;
+
+void Envelope_Build(void){
+    double ux[4]={1,-1,0,0},uy[4]={0,0,1,-1};
+    //what Safety_Override() asks for in each case, moving up it only
+    //cuts the main thruster and lets gravity brake
+    double wx[4]={-RT_ACCEL,LT_ACCEL,0,0},wy[4]={0,0,0,MT_ACCEL};
+    double rate=MAX_ROT_RATE*180/PI;
+    for(int m=0;m<8;m++)
+        for(int d=0;d<4;d++){
+            double att=0,pm=0,pl=0,pr=0;
+            bool can=d==ENV_UP || Alloc_Mask(m,0,wx[d],wy[d],&att,&pm,&pl,&pr);
+            int turn=(int)fmax(0,ceil(fabs(Angle_Diff(att,0))/rate)-ALIGN_TICKS);
+            Env_Att[m][d]=att;
+            Env_Turn[m][d]=turn*T_STEP;
+            double th=att*PI/180;
+            double ax=sin(th)*MT_ACCEL*pm+cos(th)*LT_ACCEL*pl-cos(th)*RT_ACCEL*pr;
+            double ay=cos(th)*MT_ACCEL*pm-sin(th)*LT_ACCEL*pl+sin(th)*RT_ACCEL*pr-G_ACCEL;
+            for(int k=0;k<ENV_NV;k++){
+                Env_Stop[m][d][k]=-1;
+                if(!can) continue;
+                double vx=ux[d]*k*ENV_VS,vy=uy[d]*k*ENV_VS,dist=0;
+                int t;
+                for(t=0;t<ENV_TMAX;t++){
+                    double v=vx*ux[d]+vy*uy[d];
+                    if(v<=0) break;
+                    //thrusters stay off until we are turned
+                    vx+=(t<turn ? 0 : ax)*T_STEP;
+                    vy+=(t<turn ? -G_ACCEL : ay)*T_STEP;
+                    dist+=(v+fmax(0,vx*ux[d]+vy*uy[d]))/2*T_STEP*S_SCALE;
+                }
+                if(t<ENV_TMAX) Env_Stop[m][d][k]=dist;
+            }
+        }
+    Env_Init=true;
+}
+
+//Sonar range at which to start braking. Readings are held between
+//pings, so allow for one ping period of travel on top.
+double Env_Limit(double stop,double v){
+    return stop+ENV_HALF+ENV_MARGIN+fabs(v)*Sonar_Period*T_STEP*S_SCALE;
+}
+
+//Pixels needed to stop moving in direction d at speed v with the
+//thrusters we have now, or -1 if the table cannot tell
+double Env_Stop_Dist(int d,double v){
+    if(!Env_Init) Envelope_Build();
+    int m=(MT_OK_N?1:0)|(LT_OK_N?2:0)|(RT_OK_N?4:0);
+    double f=fabs(v)/ENV_VS;
+    if(f>ENV_NV-1) return -1;
+    int k=(int)f;
+    if(k>ENV_NV-2) k=ENV_NV-2;
+    double a=f-k,s0=Env_Stop[m][d][k],s1=Env_Stop[m][d][k+1];
+    if(s0<0 || s1<0) return -1;
+    double extra=0;
+    if(d!=ENV_UP) extra=fmax(0,Time_To_Align(Env_Att[m][d])-ALIGN_TICKS*T_STEP-Env_Turn[m][d]);
+    return (1-a)*s0+a*s1+extra*fabs(v)*S_SCALE;
+}
+
 //*******************zhu*******************//
 
 
@@ -723,6 +1868,7 @@ void Lander_Control(void)
         Position_A_Y();
         Velocity_A_X();
         Velocity_A_Y();
+        Position_A_TH();
         l=l+1; //l is the sampling length
     }else{
         n=n+1;//test first
@@ -730,6 +1876,7 @@ void Lander_Control(void)
         Position_A_Y();
         Velocity_A_X();
         Velocity_A_Y();
+        Position_A_TH();
         l=1;
     }
     
@@ -738,9 +1885,20 @@ void Lander_Control(void)
     if(VX_OK)Velocity_X_N=Velocity_X();//VX_Past;
     if(VY_OK)Velocity_Y_N=Velocity_Y();
     if(TH_OK)TH_Position_N=Angle();
-    
-    
-    
+    Angle_Estimate();
+    Rot_Commit();//attitude asked for last tick
+    Thrust_Tick++;
+    Thruster_Monitor();
+
+    Occ_Update();
+
+    if(!X_OK || !Y_OK){
+        if(!PF_On) PF_Start(Position_X_N,Position_Y_N);
+        PF_Step();
+        if(!X_OK) Position_X_N=PF_Est_X;
+        if(!Y_OK) Position_Y_N=PF_Est_Y;
+    }
+
     /******************************/
  /*
    This is the main control function for the lander. It attempts
@@ -833,6 +1991,9 @@ void Lander_Control(void)
  //   stay_X_degree(0);
     
     
+    if(Path_On && Path_Control()) return;
+    if(MPC_On && MPC_Control()) return;
+
     //*******zhu***********//
     //Too close surface in Vertical direction, no action.
     printf("last distance X:.......%f\n",(PLAT_X-Position_X_N));
@@ -851,11 +2012,17 @@ void Lander_Control(void)
     }
     
     if(fabs(PLAT_Y-Position_Y_N)<last_d){
-        stay_X_degree(0);
-        Left_Thruster(0);
-        Right_Thruster(0);
-        Main_Thruster(0);
-        double x=Angle();
+        //The policy comes down slowly, damp any drift on the way: with the
+        //side thrusters if they can push while upright, else lean the main
+        //thruster by a few degrees against the drift
+        double lean=0;
+        if(Policy_On && MT_OK_N && !LT_OK_N && !RT_OK_N) lean=fmax(-POL_LEAN,fmin(POL_LEAN,-2*Velocity_X_N));
+        Robust_Off();
+        stay_X_degree(lean<0?360+lean:lean);
+        if(Policy_On && MT_OK_N && Policy_Up(PLAT_Y-Position_Y_N,Velocity_Y_N)) Fire_Main(1.0);
+        if(Policy_On && LT_OK_N && Velocity_X_N<-0.2) Fire_Left(fmin(1,-Velocity_X_N/5));
+        if(Policy_On && RT_OK_N && Velocity_X_N>0.2) Fire_Right(fmin(1,Velocity_X_N/5));
+        double x=TH_Position_N;
         printf("Want to Landing.... Ag = %f Y= %f\n",x,PLAT_Y-Position_Y_N);
         
         return;
@@ -867,23 +2034,23 @@ void Lander_Control(void)
  {
   // Lander is to the LEFT of the landing platform, use Right thrusters to move
   // lander to the left.
-  Left_Thruster(0);	// Make sure we're not fighting ourselves here!
+  Fire_Left(0);	// Make sure we're not fighting ourselves here!
      if (Velocity_X_N>(-VXlim)) Robust_Right_Thruster((VXlim+fmin(0,Velocity_X_N))/VXlim);
      else
      {
          // Exceeded velocity limit, brake
-         Right_Thruster(0);
+         Fire_Right(0);
          Robust_Left_Thruster(fabs(VXlim-Velocity_X_N));
      }
  }
  else
  {
   // Lander is to the RIGHT of the landing platform, opposite from above
-  Right_Thruster(0);
+  Fire_Right(0);
   if (Velocity_X_N<VXlim) Robust_Left_Thruster((VXlim-fmax(0,Velocity_X_N))/VXlim);
   else
   {
-   Left_Thruster(0);
+   Fire_Left(0);
    Robust_Right_Thruster(fabs(VXlim-Velocity_X_N));//Right_Thruster(fabs(VXlim-Velocity_X_N));
   }
  }
@@ -891,8 +2058,20 @@ void Lander_Control(void)
  // Vertical adjustments. Basically, keep the module below the limit for
  // vertical velocity and allow for continuous descent. We trust
  // Safety_Override() to save us from crashing with the ground.
- if (Velocity_Y_N<VYlim) Robust_Main_Thruster(1.0);
- else Main_Thruster(0);
+ // With the policy table on it replaces the VYlim steps, except when
+ // we are holding altitude to get over the platform first.
+ bool up;
+ if (Policy_On && VYlim!=0) {
+     // Not over the platform yet: stop 100 pixels short and wait there.
+     // The slow final descent has no horizontal control, so also wait
+     // until we have stopped drifting.
+     double h=PLAT_Y-Position_Y_N;
+     if (fabs(PLAT_X-Position_X_N)>20 || fabs(Velocity_X_N)>POL_VX_LAND) h-=100;
+     up=h>0 ? Policy_Up(h,Velocity_Y_N) : Velocity_Y_N<0;
+ }
+ else up=Velocity_Y_N<VYlim;
+ if (up) Robust_Main_Thruster(1.0);
+ else Robust_Main_Thruster(0);
 }
 
 void Safety_Override(void)
@@ -964,26 +2143,26 @@ void Safety_Override(void)
  // Determine whether we're too close for comfort. There is a reason
  // to have this distance limit modulated by horizontal speed...
  // what is it?
- if (dmin<DistLimit*fmax(.25,fmin(fabs(Velocity_X_N)/5.0,1)))
+ // With the stopping distance table, brake exactly when we need to.
+ double stop=Env_Stop_Dist(Velocity_X_N>0?ENV_RIGHT:ENV_LEFT,Velocity_X_N);
+ double lim=stop<0 ? DistLimit*fmax(.25,fmin(fabs(Velocity_X_N)/5.0,1)) : Env_Limit(stop,Velocity_X_N);
+ if (dmin<lim)
  { // Too close to a surface in the horizontal direction
      if(fabs(PLAT_Y-Position_Y_N)<30){
  
-  if (Angle()>1&&Angle()<359)
+  if (TH_Position_N>1&&TH_Position_N<359)
   {
-   if (Angle()>=180) Rotate(360-Angle());
-   else Rotate(-Angle());
+   stay_X_degree(0);
    return;
   }
      }
      
   if (Velocity_X_N>0){
    Robust_Right_Thruster(1.0);
-   Left_Thruster(0.0);
   }
   else
   {
    Robust_Left_Thruster(1.0);
-   Right_Thruster(0.0);
   }
  }
 
@@ -1001,20 +2180,22 @@ void Safety_Override(void)
   for (int i=14; i<22; i++)
    if (SONAR_DIST[i]>-1&&SONAR_DIST[i]<dmin) dmin=SONAR_DIST[i];
  }
- if (dmin<DistLimit)   // Too close to a surface in the horizontal direction
+ if (Velocity_Y_N>5) stop=Env_Stop_Dist(ENV_UP,Velocity_Y_N);
+ else stop=Env_Stop_Dist(ENV_DOWN,fmax(0,-Velocity_Y_N));
+ lim=stop<0 ? DistLimit : Env_Limit(stop,Velocity_Y_N);
+ if (dmin<lim)   // Too close to a surface in the horizontal direction
  {
 
     if(fabs(PLAT_Y-Position_Y_N)<30){
 
-  if (Angle()>1||Angle()>359)
+  if (TH_Position_N>1||TH_Position_N>359)
   {
-   if (Angle()>=180) Rotate(360-Angle());
-   else Rotate(-Angle());
+   stay_X_degree(0);
    return;
   }
     }
   if (Velocity_Y_N>2.0){
-   Main_Thruster(0.0);
+   Robust_Main_Thruster(0);
   }
   else
   {
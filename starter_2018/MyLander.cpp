@@ -415,15 +415,51 @@ float PIDX_realizeInc(float optimalPosition) {
 
 
 
+double Rot_Target = -1, Rot_Want = -1;
+int Rot_Ticks = 0;
+
+// Shortest signed turn from 'from' to 'to', clockwise positive
+double Angle_Diff(double to, double from) {
+    double d = fmod(to - from, 360.0);
+    if (d > 180) d -= 360;
+    if (d <= -180) d += 360;
+    return d;
+}
+
+// Steps needed to turn through 'deg' at MAX_ROT_RATE
+int Rotation_Ticks(double deg) {
+    return (int)ceil(fabs(deg) / (MAX_ROT_RATE * 180 / PI));
+}
+
+// The horizontal and vertical helpers both ask for an attitude in the
+// same tick. Only record the request here, the last one of the tick wins
+// and Rot_Commit() acts on it once at the start of the next tick.
 void stay_X_degree(double X) {
-    if (fabs(TH_Position_N-X)>2){
-        double left = int(360 - TH_Position_N + X) % 360;
-        double right = int(360 - X + TH_Position_N) % 360;
-        if (left < right) Rotate(left);
-        else Rotate(-right);
+    Rot_Want = X;
+}
+
+// Only send a new Rotate() when the target changes or the last turn
+// should have finished, otherwise we keep restarting the same turn.
+void Rot_Commit(void) {
+    if (Rot_Want < 0) return;
+    double X = Rot_Want, d = Angle_Diff(X, TH_Position_N);
+    Rot_Want = -1;
+    if (fabs(d) <= 2) {
+        Rot_Target = X;
+        return;
+    }
+    if (Rot_Target < 0 || fabs(Angle_Diff(X, Rot_Target)) > 2 || Rot_Ticks == 0) {
+        Rotate(d);
+        Rot_Target = X;
+        Rot_Ticks = Rotation_Ticks(d);
     }
 }
 
+// Seconds until the lander points at X
+double Time_To_Align(double X) {
+    return Rotation_Ticks(Angle_Diff(X, TH_Position_N)) * T_STEP;
+}
+
 void stay_zero_degree(void){
   stay_X_degree(0);
 }
@@ -571,6 +607,8 @@ void Lander_Control(void) {
     if(VX_OK)Velocity_X_N=Velocity_X();//VX_Past;
     if(VY_OK)Velocity_Y_N=Velocity_Y();
     if(TH_OK)TH_Position_N=Angle();
+    if (Rot_Ticks > 0) Rot_Ticks--;
+    Rot_Commit();
     
     
     /*PIDX_realizeInc